@@ -3,6 +3,12 @@
 #include <mpi.h>
 #include <unistd.h>
 #include <math.h>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <random>
+#include <vector>
 
 //4, 6, 7
 
@@ -93,33 +99,443 @@ public:
     }
 };
 
+enum class SamplingMode {
+    PseudoRandom,
+    Sobol
+};
+
+struct IntegrationOptions {
+    SamplingMode mode = SamplingMode::Sobol;
+    double target_stderr = 1e-4;
+    double time_budget = 10.0;       // seconds of wall time
+    long batch_size = 4096;          // points sampled between polls of the running reduction
+    long min_points = 1024;          // points per rank before the error estimate is trusted
+    int replicas = 8;                // independent scramblings of the Sobol sequence, at least 2
+    unsigned long long seed = 0;
+};
+
+struct IntegrationResult {
+    double value;
+    double std_error;
+    long long evaluations;           // integrand calls, points times replicas in Sobol mode
+    double elapsed;
+    bool converged;                  // std_error of the returned value is within target_stderr
+};
+
+// Sobol' points in [0, 1)^dim (Joe-Kuo direction numbers), randomized by a
+// nested uniform (Owen) scramble so that independent replicas give an error estimate.
+class SobolSequence {
+public:
+    static const int MAX_DIMENSION = 16;
+    static const uint64_t MAX_POINTS = 1ull << 32;
+
+    explicit SobolSequence(int dim) : dim_(dim), index_(0), x_(dim, 0), v_(dim * 32) {
+        static const int s[MAX_DIMENSION] = {0, 1, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 6, 6, 6};
+        static const unsigned a[MAX_DIMENSION] = {0, 0, 1, 1, 2, 1, 4, 2, 4, 7, 11, 13, 14, 1, 13, 16};
+        static const unsigned m[MAX_DIMENSION][6] = {
+                {0},
+                {1},
+                {1, 3},
+                {1, 3, 1},
+                {1, 1, 1},
+                {1, 1, 3, 3},
+                {1, 3, 5, 13},
+                {1, 1, 5, 5, 17},
+                {1, 1, 5, 5, 5},
+                {1, 1, 7, 11, 19},
+                {1, 1, 5, 1, 1},
+                {1, 1, 1, 3, 11},
+                {1, 3, 5, 5, 31},
+                {1, 3, 3, 9, 7, 49},
+                {1, 1, 1, 15, 21, 21},
+                {1, 3, 1, 13, 27, 49}
+        };
+        for (int j = 0; j < dim; ++j) {
+            uint32_t *v = &v_[j * 32];
+            if (j == 0) {
+                for (int i = 0; i < 32; ++i) {
+                    v[i] = 1u << (31 - i);
+                }
+                continue;
+            }
+            for (int i = 0; i < s[j]; ++i) {
+                v[i] = m[j][i] << (31 - i);
+            }
+            for (int i = s[j]; i < 32; ++i) {
+                v[i] = v[i - s[j]] ^ (v[i - s[j]] >> s[j]);
+                for (int k = 1; k < s[j]; ++k) {
+                    v[i] ^= ((a[j] >> (s[j] - 1 - k)) & 1u) * v[i - k];
+                }
+            }
+        }
+    }
+
+    // Jumps to the point with the given index (< MAX_POINTS) by XOR-ing the
+    // direction numbers selected by the bits of its Gray code.
+    void seek(uint64_t index) {
+        uint32_t gray = (uint32_t) (index ^ (index >> 1));
+        for (int j = 0; j < this->dim_; ++j) {
+            uint32_t x = 0;
+            for (int c = 0; c < 32; ++c) {
+                if (gray >> c & 1u) {
+                    x ^= this->v_[j * 32 + c];
+                }
+            }
+            this->x_[j] = x;
+        }
+        this->index_ = index;
+    }
+
+    // Moves to the next point in Gray-code order; the caller keeps the index below MAX_POINTS.
+    void advance() {
+        uint64_t next = this->index_ + 1;
+        int c = 0;
+        while (!(next >> c & 1u)) {
+            c++;
+        }
+        for (int j = 0; j < this->dim_; ++j) {
+            this->x_[j] ^= this->v_[j * 32 + c];
+        }
+        this->index_ = next;
+    }
+
+    // Unscrambled coordinates of the current point.
+    const uint32_t *point() const {
+        return this->x_.data();
+    }
+
+    static double scramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        x = reverseBits(x);
+        return ((double) x + 0.5) / 4294967296.0;
+    }
+
+private:
+    int dim_;
+    uint64_t index_;
+    std::vector<uint32_t> x_;
+    std::vector<uint32_t> v_;
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+};
+
+// Integrates f over the box [lower, upper] on every rank of comm until the
+// combined standard error drops below target_stderr or time_budget runs out.
+//
+// Each rank keeps sampling while the running sums of all ranks are combined
+// with MPI_Iallreduce; a new reduction is posted as soon as the previous one
+// completes. Every rank takes the stop decision from the same reduced
+// snapshot, so all ranks act on the same reduction round. A snapshot that
+// meets the target is confirmed by a blocking MPI_Allreduce of the current
+// sums, and sampling resumes if the confirmed error is still too large.
+//
+// In PseudoRandom mode the error comes from the sample variance. In Sobol
+// mode all ranks share the replicas' scramblings and take strided blocks of
+// batch_size points, so every rank extends every replica; the error comes
+// from the spread of the replica means. Sobol sums only include the rounds
+// of blocks every rank has completed (as of the previous reduction), so the
+// combined points always form a prefix of the sequence.
+class MonteCarloIntegrator {
+public:
+    typedef std::function<double(const double *)> Integrand;
+
+    MonteCarloIntegrator(Integrand f, std::vector<double> lower, std::vector<double> upper,
+                         IntegrationOptions options = IntegrationOptions())
+            : f_(f), lower_(lower), upper_(upper), options_(options) {
+    }
+
+    IntegrationResult integrate(MPI_Comm comm) {
+        int rank, comm_size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &comm_size);
+        this->validate(comm, rank);
+        const int dim = (int) this->lower_.size();
+
+        std::vector<double> width(dim);
+        double volume = 1.0;
+        std::vector<double> point(dim);
+        for (int j = 0; j < dim; ++j) {
+            width[j] = this->upper_[j] - this->lower_[j];
+            volume *= width[j];
+            point[j] = this->lower_[j] + 0.5 * width[j];
+        }
+        // Sums are accumulated around f(center), known to every rank without
+        // communication, to keep sum - sum^2 / n from cancelling.
+        const double shift = this->f_(point.data());
+
+        const bool sobol = this->options_.mode == SamplingMode::Sobol;
+        const int replicas = sobol ? this->options_.replicas : 1;
+        const long batch = this->options_.batch_size;
+        // The wall clock is read about once per BUDGET_CHECK_INTERVAL evaluations;
+        // a smaller batch_size tightens the budget further.
+        long check_interval = BUDGET_CHECK_INTERVAL / replicas;
+        check_interval = std::max(1L, std::min(batch, check_interval));
+        std::vector<uint32_t> scramble_seeds(sobol ? replicas * dim : 0);
+        for (int r = 0; r < replicas && sobol; ++r) {
+            for (int j = 0; j < dim; ++j) {
+                scramble_seeds[r * dim + j] = (uint32_t) mix(this->options_.seed, r * dim + j);
+            }
+        }
+        SobolSequence sequence(sobol ? dim : 1);
+        std::mt19937_64 generator(mix(this->options_.seed, rank));
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        Reduction state(replicas);
+        std::vector<double> &local = state.local;
+        std::vector<double> &global = state.global;
+        long long points = 0;
+        bool exhausted = false;
+        bool converged = false;
+        const double start = MPI_Wtime();
+
+        while (true) {
+            long count = 0;
+            // The rank's first point is always drawn so the final estimate is defined.
+            bool stopped = exhausted || (points > 0 && overBudget(start));
+            if (sobol && !stopped) {
+                uint64_t first = ((uint64_t) state.complete * comm_size + rank) * (uint64_t) batch;
+                if (first >= SobolSequence::MAX_POINTS) {
+                    exhausted = true;
+                } else {
+                    count = (long) std::min<uint64_t>(batch, SobolSequence::MAX_POINTS - first);
+                    sequence.seek(first);
+                    state.pending.push_back(std::vector<double>(1 + replicas, 0.0));
+                }
+            } else if (!stopped) {
+                count = batch;
+            }
+            long drawn = 0;
+            long next_check = 0;
+            for (; drawn < count; ++drawn) {
+                if (drawn == next_check) {
+                    if (points > 0 && overBudget(start)) {
+                        break;
+                    }
+                    next_check += check_interval;
+                }
+                if (sobol) {
+                    if (drawn > 0) {
+                        sequence.advance();
+                    }
+                    const uint32_t *x = sequence.point();
+                    std::vector<double> &block = state.pending.back();
+                    for (int r = 0; r < replicas; ++r) {
+                        for (int j = 0; j < dim; ++j) {
+                            point[j] = this->lower_[j] +
+                                       width[j] * SobolSequence::scramble(x[j], scramble_seeds[r * dim + j]);
+                        }
+                        block[1 + r] += this->f_(point.data()) - shift;
+                    }
+                    block[0]++;
+                } else {
+                    for (int j = 0; j < dim; ++j) {
+                        point[j] = this->lower_[j] + width[j] * uniform(generator);
+                    }
+                    double d = this->f_(point.data()) - shift;
+                    local[0]++;
+                    local[2] += d * d;
+                    local[3] += d;
+                }
+                points++;
+            }
+            if (sobol && count > 0 && drawn == count) {
+                state.complete++;
+            }
+
+            if (state.requests[0] != MPI_REQUEST_NULL) {
+                int done = 0;
+                MPI_Testall(2, state.requests, &done, MPI_STATUSES_IGNORE);
+                if (!done) {
+                    continue;
+                }
+                state.common = state.common_snapshot;
+                if (global[1] == 0 && !this->reachedTarget(global, comm_size, volume)) {
+                    this->post(state, exhausted, start, comm);
+                    continue;
+                }
+                MPI_Allreduce(&state.complete, &state.common, 1, MPI_LONG_LONG, MPI_MIN, comm);
+                state.commit(state.common);
+                local[1] = exhausted || overBudget(start) ? 1 : 0;
+                MPI_Allreduce(local.data(), global.data(), 3 + replicas, MPI_DOUBLE, MPI_SUM, comm);
+                if (this->reachedTarget(global, comm_size, volume)) {
+                    converged = true;
+                    break;
+                }
+                if (global[1] > 0) {
+                    if (global[0] == 0) {
+                        // Not one block was completed everywhere; fall back to every point drawn.
+                        state.commit(state.committed + (long long) state.pending.size());
+                        MPI_Allreduce(local.data(), global.data(), 3 + replicas, MPI_DOUBLE, MPI_SUM, comm);
+                    }
+                    break;
+                }
+            }
+            this->post(state, exhausted, start, comm);
+        }
+
+        double sum = 0;
+        for (int r = 0; r < replicas; ++r) {
+            sum += global[3 + r];
+        }
+        IntegrationResult result;
+        result.value = volume * (shift + sum / (global[0] * replicas));
+        result.std_error = volume * this->standardError(global);
+        result.evaluations = (long long) global[0] * replicas;
+        result.elapsed = MPI_Wtime() - start;
+        result.converged = converged;
+        return result;
+    }
+
+private:
+    Integrand f_;
+    std::vector<double> lower_;
+    std::vector<double> upper_;
+    IntegrationOptions options_;
+
+    static const long BUDGET_CHECK_INTERVAL = 256;
+
+    // Sums exchanged between ranks: points, stop requested, sum((f - shift)^2)
+    // (PseudoRandom only), then sum(f - shift) of every replica. In Sobol mode
+    // local only holds committed blocks; the rest wait in pending as
+    // {points, replica sums} until every rank has completed them.
+    struct Reduction {
+        std::vector<double> local;
+        std::vector<double> snapshot;
+        std::vector<double> global;
+        std::deque<std::vector<double> > pending;
+        long long committed;
+        long long complete;
+        long long complete_snapshot;
+        long long common;
+        long long common_snapshot;
+        MPI_Request requests[2];
+
+        explicit Reduction(int replicas)
+                : local(3 + replicas, 0.0), snapshot(3 + replicas), global(3 + replicas, 0.0), committed(0),
+                  complete(0), complete_snapshot(0), common(0), common_snapshot(0) {
+            requests[0] = MPI_REQUEST_NULL;
+            requests[1] = MPI_REQUEST_NULL;
+        }
+
+        // Moves pending blocks into local until `blocks` of them are committed.
+        void commit(long long blocks) {
+            for (; this->committed < blocks && !this->pending.empty(); ++this->committed) {
+                const std::vector<double> &block = this->pending.front();
+                this->local[0] += block[0];
+                for (size_t r = 1; r < block.size(); ++r) {
+                    this->local[2 + r] += block[r];
+                }
+                this->pending.pop_front();
+            }
+        }
+    };
+
+    void validate(MPI_Comm comm, int rank) {
+        const char *error = nullptr;
+        if (this->lower_.empty() || this->lower_.size() != this->upper_.size()) {
+            error = "lower and upper bounds must be non-empty and of equal dimension";
+        } else if (this->options_.batch_size <= 0) {
+            error = "batch_size must be positive";
+        } else if (this->options_.min_points <= 0) {
+            error = "min_points must be positive";
+        } else if (this->options_.time_budget <= 0) {
+            error = "time_budget must be positive";
+        } else if (this->options_.mode == SamplingMode::Sobol && this->options_.replicas < 2) {
+            error = "Sobol sampling needs at least 2 replicas to estimate the error";
+        } else if (this->options_.mode == SamplingMode::Sobol &&
+                   this->lower_.size() > (size_t) SobolSequence::MAX_DIMENSION) {
+            error = "Sobol sampling supports up to 16 dimensions";
+        }
+        if (error != nullptr) {
+            if (rank == 0) {
+                printf("MonteCarloIntegrator: %s\n", error);
+            }
+            MPI_Abort(comm, 1);
+        }
+    }
+
+    bool overBudget(double start) const {
+        return MPI_Wtime() - start > this->options_.time_budget;
+    }
+
+    // Posts the next round: the sums up to the last known common block count,
+    // and the count of blocks this rank has completed by now.
+    void post(Reduction &state, bool exhausted, double start, MPI_Comm comm) {
+        state.commit(state.common);
+        state.local[1] = exhausted || overBudget(start) ? 1 : 0;
+        state.snapshot = state.local;
+        state.complete_snapshot = state.complete;
+        MPI_Iallreduce(state.snapshot.data(), state.global.data(), (int) state.snapshot.size(), MPI_DOUBLE,
+                       MPI_SUM, comm, &state.requests[0]);
+        MPI_Iallreduce(&state.complete_snapshot, &state.common_snapshot, 1, MPI_LONG_LONG, MPI_MIN, comm,
+                       &state.requests[1]);
+    }
+
+    bool reachedTarget(const std::vector<double> &sums, int comm_size, double volume) const {
+        return sums[0] >= (double) this->options_.min_points * comm_size &&
+               volume * this->standardError(sums) <= this->options_.target_stderr;
+    }
+
+    double standardError(const std::vector<double> &sums) const {
+        double n = sums[0];
+        if (this->options_.mode == SamplingMode::PseudoRandom) {
+            if (n < 2) {
+                return HUGE_VAL;
+            }
+            double variance = (sums[2] - sums[3] * sums[3] / n) / (n - 1);
+            return sqrt(std::max(variance, 0.0) / n);
+        }
+        const int replicas = this->options_.replicas;
+        double mean = 0, squares = 0;
+        for (int r = 0; r < replicas; ++r) {
+            double m = sums[3 + r] / n;
+            mean += m;
+            squares += m * m;
+        }
+        double variance = (squares - mean * mean / replicas) / (replicas - 1);
+        return sqrt(std::max(variance, 0.0) / replicas);
+    }
+
+    static unsigned long long mix(unsigned long long seed, unsigned long long stream) {
+        unsigned long long z = seed + (stream + 1) * 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+};
+
 class MPITask_3 : public Strategy {
 public:
     void execute() override {
-        int rank, comm_size;
-        int count = 10000000;
-        int condition_count = 0;
-        double x, y;
+        int rank;
         MPI_Init(NULL, NULL);
         MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-        MPI_Comm_size(MPI_COMM_WORLD, &comm_size);
-        srand(rank*comm_size);
-        int local_size = count / comm_size;
-        int local_count = 0;
 
-        for (int i = rank * local_size; i < rank * local_size + local_size; i++) {
-            x = (double) rand() / (double) RAND_MAX;
-            y = (double) rand() / (double) RAND_MAX;
-            if (pow(x, 2) + pow(y, 2) <= 1)
-                local_count++;
-        }
+        IntegrationOptions options;
+        options.mode = SamplingMode::Sobol;
+        options.target_stderr = 1e-5;
+        options.time_budget = 10.0;
 
-        printf("Local count = %d from process %d\n", local_count, rank);
-        MPI_Reduce(&local_count, &condition_count, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+        MonteCarloIntegrator integrator([](const double *p) {
+            return p[0] * p[0] + p[1] * p[1] <= 1 ? 4.0 : 0.0;
+        }, {0.0, 0.0}, {1.0, 1.0}, options);
+        IntegrationResult result = integrator.integrate(MPI_COMM_WORLD);
 
         if (rank == 0) {
-            double answer = (double) (4 * condition_count) / (double) count;
-            printf("Pi = %f\n", answer);
+            printf("Pi = %f +- %e\n", result.value, result.std_error);
+            printf("Evaluations = %lld, time = %f s, %s\n", result.evaluations, result.elapsed,
+                   result.converged ? "converged" : "stopped before reaching the target");
         }
         MPI_Finalize();
     }